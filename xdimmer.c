@@ -28,11 +28,13 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #ifdef __linux__
 #include <bsd/stdlib.h>
@@ -40,7 +42,11 @@
 #include <stdlib.h>
 #endif
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #ifdef __linux__
 #include <bsd/sys/poll.h>
 #else
@@ -48,9 +54,9 @@
 #endif
 
 #ifdef __OpenBSD__
-#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <dev/wscons/wsconsio.h>
+#include <sys/sched.h>
 #include <sys/sysctl.h>
 #include <sys/sensors.h>
 #include <errno.h>
@@ -59,6 +65,7 @@
 #include <X11/X.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/shape.h>
 #include <X11/extensions/sync.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/XInput.h>
@@ -70,6 +77,24 @@
 #define DEFAULT_DIM_STEPS	20
 #define DEFAULT_BRIGHTEN_STEPS	5
 
+/* how often to read the ambient light sensor */
+#define ALS_POLL_MSECS		1000
+
+/* how often to summarize accounting when debugging */
+#define ACCT_SUMMARY_SECS	3600
+
+/* idle histogram file */
+#define HIST_MAGIC		0x78646831	/* "xdh1" */
+#define HIST_BUCKETS		24
+#define HIST_FALSE_ALARM_SECS	8
+
+/* backlight levels within this are the same, allowing for hardware rounding */
+#define LEVEL_EQ(a, b)		(fabsf((a) - (b)) < 0.5)
+
+#ifndef QUIRKS_FILE
+#define QUIRKS_FILE		"/usr/local/share/xdimmer/quirks"
+#endif
+
 enum {
 	OP_GET,
 	OP_SET,
@@ -79,6 +104,78 @@ enum {
 	MSG_EXIT = 1,
 	MSG_DIM,
 	MSG_BRIGHTEN,
+	MSG_STATS,
+};
+
+enum {
+	CURVE_LINEAR,
+	CURVE_LOG,
+};
+
+/* per-device backlight limits, from QUIRKS_FILE */
+struct quirk {
+	int min_level;		/* lowest usable backlight percentage */
+	int write_interval;	/* minimum msecs between backlight writes */
+	int curve;		/* how to step between levels */
+};
+
+/*
+ * Each backlight is modelled as layers which are combined into one target
+ * level on every step of a fade: the base level (from the ALS, or whatever the
+ * user had set), a manual offset the user made on top of the ALS level, and
+ * the level used while dimmed.
+ */
+struct channel {
+	float base;
+	float offset;
+	float dim;
+	float min;	/* lowest usable level */
+	float cur;	/* last level asked for, -1 if unknown */
+	float hw;	/* what the hardware then reported, -1 if unknown */
+};
+
+/* subsystems for accounting of our own cpu time and wakeups */
+enum {
+	ACCT_OTHER,
+	ACCT_X,
+	ACCT_SIGNAL,
+	ACCT_ALS,
+	ACCT_FADE,
+	ACCT_MAX,
+};
+
+struct acct_counter {
+	unsigned long wakeups;
+	struct timespec cpu;
+};
+
+/* wall time and system-wide cpu usage spent in one dimmed state */
+struct acct_state_counter {
+	double secs;
+	unsigned long long busy;
+	unsigned long long total;
+};
+
+/*
+ * Persistent histograms of how long each idle period that reached the dim
+ * timeout lasted, and how long after dimming the user returned.  Bucket 0
+ * holds periods under 1 second, bucket n holds [2^(n-1), 2^n) seconds.
+ */
+struct idle_hist {
+	uint32_t magic;
+	uint32_t min_timeout;	/* shortest -t used while recording */
+	uint64_t idle_count[HIST_BUCKETS];
+	uint64_t idle_secs[HIST_BUCKETS];
+	uint64_t return_count[HIST_BUCKETS];
+	uint64_t return_secs[HIST_BUCKETS];
+};
+
+static const char *acct_names[ACCT_MAX] = {
+	"other",
+	"x events",
+	"signals",
+	"als",
+	"fades",
 };
 
 #ifdef __OpenBSD__
@@ -106,11 +203,39 @@ void set_alarm(XSyncAlarm *, XSyncTestType);
 void bail(int);
 void sigusr1(int);
 void sigusr2(int);
-void stepper(float, float, int, int);
+void sighup(int);
+float channel_target(struct channel *);
+void fade(int, int);
+int fade_interrupted(void);
+void channels_sync(void);
 float backlight_op(int, float);
 float kbd_backlight_op(int, float);
 int als_find_sensor(void);
-void als_fetch(void);
+int als_fetch(void);
+int als_due(void);
+int acct_enter(int);
+void acct_wakeup(int);
+void acct_report(const char *, struct acct_counter *,
+    struct acct_state_counter *, struct timespec *, long);
+void acct_summary(void);
+void acct_state(int);
+void set_dimmed(int);
+void state_publish(void);
+void hist_open(const char *, int);
+void hist_record(uint64_t, uint64_t);
+void hist_report(void);
+void quirks_load(const char *);
+void backlight_ratelimit(void);
+void gamma_init(void);
+float gamma_op(int, float);
+void gamma_fetch_color(void);
+void gamma_apply(void);
+void gamma_load_crtcs(void);
+void gamma_restore(void);
+int gamma_event(XEvent *);
+void gamma_handle_event(XEvent *);
+float overlay_op(int, float);
+void overlay_layout(void);
 void usage(void);
 int XPeekEventOrTimeout(Display *, XEvent *, unsigned int);
 int pipemsg[2];
@@ -120,16 +245,23 @@ extern char *__progname;
 /* options */
 static int dim_kbd = 0;
 static int dimmed = 0;
+static int fading = 0;
 static int dim_screen = 1;
 static int use_als = 0;
 static int kbd_idle_only = 0;
+static char *hist_file = NULL;
+static int hist_query = 0;
+static int use_gamma = 0;
+static int use_overlay = 0;
+static char *state_cmd = NULL;
 
 /* ALS reading */
 static float als = -1;
+static struct timespec als_polled;
 
-/* backlight reading and target while dimming/undimming */
-static float backlight = -1;
-static float kbd_backlight = -1;
+/* screen and keyboard backlight layers */
+static struct channel screen = { -1, 0, DEFAULT_DIM_PERCENTAGE, 0, -1, -1 };
+static struct channel kbd = { -1, 0, 0, 0, -1, -1 };
 
 static int dim_timeout = DEFAULT_DIM_TIMEOUT;
 static int dim_pct = DEFAULT_DIM_PERCENTAGE;
@@ -137,13 +269,82 @@ static int dim_steps = DEFAULT_DIM_STEPS;
 static int brighten_steps = DEFAULT_BRIGHTEN_STEPS;
 
 static Atom backlight_a = 0;
+
+/*
+ * Our state is published on the root window as _XDIMMER_STATE, two cardinals
+ * of whether we're dimmed and the screen's target level, so compositors and
+ * clients can watch it with PropertyNotify and throttle rendering while dimmed
+ */
+static Atom state_a = 0;
+
+/*
+ * When dimming with gamma ramps, we own the _XDIMMER selection with an
+ * unmapped window, and color temperature tools set red, green and blue
+ * multipliers (in thousandths) as the _XDIMMER_COLOR property on it instead of
+ * writing gamma ramps themselves
+ */
+static Atom gamma_selection_a = 0;
+static Atom gamma_color_a = 0;
+static Window gamma_win = None;
+static float gamma_level = 100;
+static float gamma_color[3] = { 1.0, 1.0, 1.0 };
+static float gamma_written[3] = { -1, -1, -1 };
+static int gamma_rr_event = 0;
+static int gamma_lost = 0;
+
+/* crtcs and a ramp of each one's gamma size, refreshed on screen changes */
+static RRCrtc *gamma_crtcs = NULL;
+static XRRCrtcGamma **gamma_ramps = NULL;
+static int ngamma_crtcs = 0;
+
+/* each crtc's ramp from before we first wrote it, restored when exiting */
+static RRCrtc *gamma_saved_crtcs = NULL;
+static XRRCrtcGamma **gamma_saved = NULL;
+static int ngamma_saved = 0;
+
+/*
+ * When dimming with an overlay, one input-transparent black window covers each
+ * crtc and the compositor blends it according to its _NET_WM_WINDOW_OPACITY
+ */
+#define MAX_OVERLAYS 8
+static Window overlay_wins[MAX_OVERLAYS];
+static int noverlay_wins = 0;
+static int overlay_mapped = 0;
+static int overlay_no_cm = 0;
+static Atom overlay_opacity_a = 0;
+static Atom overlay_cm_a = 0;
+static float overlay_level = 100;
 static XSyncCounter idler_counter = 0;
+static int sync_event = 0;
 static int exiting = 0;
 static int force_dim = 0;
 static int force_brighten = 0;
 static int debug = 0;
 #define DPRINTF(x) { if (debug) { printf x; } };
 
+/* self accounting */
+static struct acct_counter acct_counters[ACCT_MAX];
+static struct acct_counter acct_last[ACCT_MAX];
+static struct timespec acct_cpu_mark;
+static struct timespec acct_start;
+static struct timespec acct_last_summary;
+static long acct_last_csw = 0;
+static int acct_cur = ACCT_OTHER;
+
+/* while bright (0) and dimmed (1) */
+static struct acct_state_counter acct_states[2];
+static struct acct_state_counter acct_states_last[2];
+static struct timespec acct_state_since;
+static unsigned long long acct_state_busy = 0;
+static unsigned long long acct_state_total = 0;
+static int acct_state_cur = 0;
+
+static struct quirk quirk = { 0, 0, CURVE_LINEAR };
+
+/* idle histogram, mapped from hist_file */
+static struct idle_hist *hist = NULL;
+static struct timespec dimmed_at;
+
 #ifdef __OpenBSD__
 static int wsconsdfd = 0;
 static int wsconskfd = 0;
@@ -157,7 +358,7 @@ main(int argc, char *argv[])
 {
 	int ch;
 
-	while ((ch = getopt(argc, argv, "ab:dkKnp:s:t:")) != -1) {
+	while ((ch = getopt(argc, argv, "ab:dgH:kKnop:qs:t:x:")) != -1) {
 		const char *errstr;
 
 		switch (ch) {
@@ -176,6 +377,12 @@ main(int argc, char *argv[])
 		case 'd':
 			debug = 1;
 			break;
+		case 'g':
+			use_gamma = 1;
+			break;
+		case 'H':
+			hist_file = optarg;
+			break;
 		case 'k':
 #ifndef __OpenBSD__
 			errx(1, "keyboard backlight not supported on this "
@@ -189,11 +396,17 @@ main(int argc, char *argv[])
 		case 'n':
 			dim_screen = 0;
 			break;
+		case 'o':
+			use_overlay = 1;
+			break;
 		case 'p':
 			dim_pct = strtonum(optarg, 1, 100, &errstr);
 			if (errstr)
 				errx(2, "dim percentage: %s", errstr);
 			break;
+		case 'q':
+			hist_query = 1;
+			break;
 		case 's':
 			dim_steps = strtonum(optarg, 1, 500, &errstr);
 			if (errstr)
@@ -204,6 +417,9 @@ main(int argc, char *argv[])
 			if (errstr)
 				errx(2, "dim timeout: %s", errstr);
 			break;
+		case 'x':
+			state_cmd = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -211,13 +427,43 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (hist_query) {
+		if (hist_file == NULL)
+			errx(1, "-q requires an idle histogram file (-H)");
+
+		hist_open(hist_file, 1);
+		hist_report();
+		return 0;
+	}
+
+	if (hist_file)
+		hist_open(hist_file, 0);
+
 	if (!dim_screen && !dim_kbd && !use_als)
 		errx(1, "not dimming screen or keyboard, nothing to do");
 
+	if (use_gamma && use_overlay)
+		errx(1, "can't dim with both gamma and an overlay");
+
 	if (!(dpy = XOpenDisplay(NULL)))
 		errx(1, "can't open display %s", XDisplayName(NULL));
 
-	if (dim_screen || use_als) {
+	if ((dim_screen || use_als) && use_gamma) {
+		gamma_init();
+		quirks_load(QUIRKS_FILE);
+	} else if ((dim_screen || use_als) && use_overlay) {
+		int shape_event, shape_error;
+		char cm_name[32];
+
+		if (!XShapeQueryExtension(dpy, &shape_event, &shape_error))
+			errx(1, "no shape extension available");
+
+		overlay_opacity_a = XInternAtom(dpy, "_NET_WM_WINDOW_OPACITY",
+		    False);
+		snprintf(cm_name, sizeof(cm_name), "_NET_WM_CM_S%d",
+		    DefaultScreen(dpy));
+		overlay_cm_a = XInternAtom(dpy, cm_name, False);
+	} else if (dim_screen || use_als) {
 		backlight_a = XInternAtom(dpy, RR_PROPERTY_BACKLIGHT, True);
 		if (backlight_a == None) {
 #ifdef __OpenBSD__
@@ -227,6 +473,8 @@ main(int argc, char *argv[])
 #endif
 				errx(1, "no backlight control");
 		}
+
+		quirks_load(QUIRKS_FILE);
 	}
 
 #ifdef __OpenBSD__
@@ -254,13 +502,37 @@ main(int argc, char *argv[])
 	signal(SIGTERM, bail);
 	signal(SIGUSR1, sigusr1);
 	signal(SIGUSR2, sigusr2);
+	signal(SIGHUP, sighup);
+
+	clock_gettime(CLOCK_MONOTONIC, &acct_start);
+	acct_last_summary = acct_start;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &acct_cpu_mark);
 
 	/* setup a pipe to wait for messages from signal handlers */
-	pipe(pipemsg);
+	if (pipe(pipemsg) == -1)
+		err(1, "pipe");
+
+	/* don't leak the X connection or our pipe into state_cmd children */
+	if (fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(pipemsg[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(pipemsg[1], F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "fcntl");
+
+	/* don't leave zombies from state_cmd around */
+	if (state_cmd)
+		signal(SIGCHLD, SIG_IGN);
+
+	state_a = XInternAtom(dpy, "_XDIMMER_STATE", False);
+
+	/* the als can still change the screen when we're not dimming it */
+	screen.dim = (dim_screen ? dim_pct : 100);
+	screen.min = quirk.min_level;
+	channels_sync();
+	set_dimmed(0);
 
 	xloop();
 
-	return 0;
+	return (gamma_lost ? 1 : 0);
 }
 
 void
@@ -271,7 +543,7 @@ xloop(void)
 	XSyncAlarm reset_alarm = None;
 	XIDeviceInfo *xinfo;
 	char masdname[25];
-	int sync_event, error;
+	int error;
 	int major, minor, ncounters, ndevices;
 	int i, j;
 
@@ -329,12 +601,23 @@ xloop(void)
 		XSyncAlarmNotifyEvent *alarm_e;
 		int do_dim = 0, do_brighten = 0;
 
+		acct_enter(ACCT_OTHER);
+		acct_summary();
+
 		DPRINTF(("waiting for next event\n"));
 
-		/* if we're checking an als, only wait 1 second for x event */
-		if (XPeekEventOrTimeout(dpy, &e, (use_als ? 1000 : 0)) == 0) {
-			if (use_als && !dimmed)
-				als_fetch();
+		/*
+		 * if we're checking an als, only wait ALS_POLL_MSECS for an x
+		 * event.  the als level is tracked while dimmed too, so
+		 * brightening goes straight to the right level.
+		 */
+		if (XPeekEventOrTimeout(dpy, &e,
+		    (use_als ? ALS_POLL_MSECS : 0)) == 0) {
+			if (use_als) {
+				acct_enter(ACCT_ALS);
+				if (als_fetch())
+					fade(dim_steps, 0);
+			}
 			continue;
 		}
 
@@ -342,12 +625,22 @@ xloop(void)
 			break;
 
 		if (force_dim) {
+			acct_enter(ACCT_SIGNAL);
 			do_dim = force_dim;
 		} else if (force_brighten) {
+			acct_enter(ACCT_SIGNAL);
 			do_brighten = force_brighten;
 		} else {
+			acct_enter(ACCT_X);
 			XNextEvent(dpy, &e);
 
+			if (gamma_event(&e)) {
+				gamma_handle_event(&e);
+				if (exiting)
+					break;
+				continue;
+			}
+
 			if (!dim_screen && !dim_kbd)
 				continue;
 
@@ -371,32 +664,55 @@ xloop(void)
 		if (do_dim && !dimmed) {
 			set_alarm(&reset_alarm, XSyncNegativeTransition);
 
-			if (dim_screen)
-				backlight = backlight_op(OP_GET, 0);
-			if (dim_kbd)
-				kbd_backlight = kbd_backlight_op(OP_GET, 0);
+			/* pick up any changes the user made before dimming */
+			channels_sync();
+
+			set_dimmed(1);
+			fade(force_dim ? 1 : dim_steps, 1);
 
-			stepper(dim_pct, 0, force_dim ? 1 : dim_steps, 1);
-			dimmed = 1;
+			/* only idle periods are worth recording */
+			if (force_dim)
+				dimmed_at.tv_sec = 0;
+			else
+				clock_gettime(CLOCK_MONOTONIC, &dimmed_at);
 		} else if (do_brighten && dimmed) {
-			if (use_als)
+			if (use_als) {
+				int prev = acct_enter(ACCT_ALS);
 				als_fetch();
+				acct_enter(prev);
+			}
 
 			set_alarm(&idle_alarm, XSyncPositiveComparison);
 
-			stepper(backlight, kbd_backlight,
-			    force_brighten ? 1 : brighten_steps, 0);
-			dimmed = 0;
+			set_dimmed(0);
+			fade(force_brighten ? 1 : brighten_steps, 0);
+
+			if (hist && !force_brighten && dimmed_at.tv_sec) {
+				struct timespec now;
+
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				hist_record(dim_timeout,
+				    now.tv_sec - dimmed_at.tv_sec);
+			}
 		}
 
 		force_dim = force_brighten = 0;
 	}
 
 	if (dimmed) {
-		DPRINTF(("restoring backlight to %f / %f before exiting\n",
-		    backlight, kbd_backlight));
-		stepper(backlight, kbd_backlight, brighten_steps, 0);
+		DPRINTF(("restoring backlight before exiting\n"));
+		set_dimmed(0);
+		fade(brighten_steps, 0);
 	}
+
+	if (use_gamma)
+		gamma_restore();
+
+	XDeleteProperty(dpy, DefaultRootWindow(dpy), state_a);
+	XFlush(dpy);
+
+	if (debug)
+		acct_report("total", NULL, NULL, &acct_start, 0);
 }
 
 void
@@ -427,69 +743,250 @@ set_alarm(XSyncAlarm *alarm, XSyncTestType test)
 	*alarm = XSyncCreateAlarm(dpy, flags, &attr);
 }
 
+/*
+ * Change whether we're dimmed, publish it on the root window, and run the
+ * state command through sh(1) with "dimmed" or "bright" as $1
+ */
 void
-stepper(float new_backlight, float new_kbd_backlight, int steps, int inter)
+set_dimmed(int d)
 {
-	float tbacklight, tkbd_backlight;
-	float step_inc = 0, kbd_step_inc = 0;
-	int j;
+	if (d != dimmed || !acct_state_since.tv_sec)
+		acct_state(d);
 
-	if (dim_screen || use_als) {
-		tbacklight = backlight_op(OP_GET, 0);
-		if (((int)new_backlight != (int)tbacklight))
-			step_inc = (new_backlight - tbacklight) / steps;
-	}
+	dimmed = d;
+
+	state_publish();
+
+	if (state_cmd == NULL)
+		return;
 
-	if (dim_kbd) {
-		tkbd_backlight = kbd_backlight_op(OP_GET, 0);
-		if ((int)new_kbd_backlight != (int)tkbd_backlight)
-			kbd_step_inc = (new_kbd_backlight - tkbd_backlight) /
-			    steps;
+	DPRINTF(("%s: running %s %s\n", __func__, state_cmd,
+	    (dimmed ? "dimmed" : "bright")));
+
+	switch (fork()) {
+	case -1:
+		warn("fork");
+		break;
+	case 0:
+		execl("/bin/sh", "sh", "-c", state_cmd, __progname,
+		    (dimmed ? "dimmed" : "bright"), (char *)NULL);
+		_exit(1);
 	}
+}
+
+/* update _XDIMMER_STATE, if our state or the screen's target has changed */
+void
+state_publish(void)
+{
+	static unsigned long published[2] = { -1, -1 };
+	unsigned long state[2];
 
-	if (!step_inc && !kbd_step_inc)
+	state[0] = dimmed;
+	state[1] = ((dim_screen || use_als) ? channel_target(&screen) : 100);
+
+	if (memcmp(state, published, sizeof(state)) == 0)
 		return;
 
-	if (dim_screen || use_als)
-		DPRINTF(("stepping from %0.2f to %0.2f in increments of %f "
-		    "(%d step%s)\n", tbacklight, new_backlight, step_inc, steps,
-		    (steps == 1 ? "" : "s")));
+	XChangeProperty(dpy, DefaultRootWindow(dpy), state_a, XA_CARDINAL, 32,
+	    PropModeReplace, (unsigned char *)state, 2);
+	XFlush(dpy);
 
-	if (dim_kbd)
-		DPRINTF(("stepping keyboard from %0.2f to %0.2f in increments "
-		    "of %f (%d step%s)\n", tkbd_backlight, new_kbd_backlight,
-		    kbd_step_inc, steps, (steps == 1 ? "" : "s")));
+	memcpy(published, state, sizeof(published));
+}
+
+float
+channel_target(struct channel *ch)
+{
+	float t = ch->base + ch->offset;
 
-	/* discard any stale alarm events */
-	XSync(dpy, True);
+	if (t > 100)
+		t = 100;
+	else if (t < 0)
+		t = 0;
 
-	for (j = 1; j <= steps; j++) {
-		XEvent e;
+	if (dimmed && ch->dim < t)
+		t = ch->dim;
 
-		if (dim_screen || use_als) {
-			if (j == steps)
-				tbacklight = new_backlight;
-			else
-				tbacklight += step_inc;
+	if (t < ch->min)
+		t = ch->min;
+
+	return t;
+}
+
+/* move ch one step closer to target, with steps steps remaining */
+static void
+channel_step(struct channel *ch, float target, int steps, int curve,
+    float (*op)(int, float))
+{
+	float next;
+
+	if (LEVEL_EQ(ch->cur, target))
+		return;
+
+	if (steps <= 1)
+		next = target;
+	else if (curve == CURVE_LOG && ch->cur > 0 && target > 0)
+		/* step by a constant ratio, which looks linear to the eye */
+		next = ch->cur * powf(target / ch->cur, 1.0 / steps);
+	else
+		next = ch->cur + ((target - ch->cur) / steps);
+
+	op(OP_SET, next);
+	ch->cur = next;
+}
+
+/*
+ * Fade every backlight towards the target of its layers in steps.  Targets
+ * are evaluated on every step, so a fade always ends wherever the layers
+ * currently say and starts from wherever the last one left off.
+ */
+void
+fade(int steps, int inter)
+{
+	float ts = 0, tk = 0;
+	int j, prev_acct, started = 0;
+
+	prev_acct = acct_enter(ACCT_FADE);
+	fading = 1;
+
+	for (j = steps; j > 0; j--) {
+		XEvent e;
 
-			backlight_op(OP_SET, tbacklight);
+		/*
+		 * keep following the als during long fades, so a change
+		 * moves this fade's target rather than starting another one
+		 */
+		if (use_als && started && als_due()) {
+			int prev = acct_enter(ACCT_ALS);
+			als_fetch();
+			acct_enter(prev);
 		}
 
-		if (dim_kbd) {
-			if (j == steps)
-				tkbd_backlight = new_kbd_backlight;
-			else
-				tkbd_backlight += kbd_step_inc;
+		if (dim_screen || use_als)
+			ts = channel_target(&screen);
+		if (dim_kbd)
+			tk = channel_target(&kbd);
+
+		if ((!(dim_screen || use_als) || LEVEL_EQ(screen.cur, ts)) &&
+		    (!dim_kbd || LEVEL_EQ(kbd.cur, tk)))
+			break;
 
-			kbd_backlight_op(OP_SET, tkbd_backlight);
+		if (!started) {
+			if (dim_screen || use_als)
+				DPRINTF(("fading screen from %0.2f to %0.2f "
+				    "(%d step%s)\n", screen.cur, ts, j,
+				    (j == 1 ? "" : "s")));
+			if (dim_kbd)
+				DPRINTF(("fading keyboard from %0.2f to %0.2f "
+				    "(%d step%s)\n", kbd.cur, tk, j,
+				    (j == 1 ? "" : "s")));
+
+			/* discard any stale alarm events, but nothing else */
+			XSync(dpy, False);
+			while (XCheckTypedEvent(dpy,
+			    sync_event + XSyncAlarmNotify, &e))
+				;
+			started = 1;
 		}
 
-		if (inter && XPeekEventOrTimeout(dpy, &e, 1) != 0) {
+		if (dim_screen || use_als)
+			channel_step(&screen, ts, j, quirk.curve,
+			    backlight_op);
+		if (dim_kbd)
+			channel_step(&kbd, tk, j, CURVE_LINEAR,
+			    kbd_backlight_op);
+
+		if (inter && fade_interrupted())
+			break;
+	}
+
+	/*
+	 * the hardware may not have landed exactly where we asked, so
+	 * remember what it reports to not mistake that for a user change
+	 */
+	if (started) {
+		if (dim_screen || use_als)
+			screen.hw = backlight_op(OP_GET, 0);
+		if (dim_kbd)
+			kbd.hw = kbd_backlight_op(OP_GET, 0);
+	}
+
+	fading = 0;
+	acct_enter(prev_acct);
+}
+
+/*
+ * Wait briefly between steps of an interruptible fade, returning 1 if input,
+ * a signal or anything else should stop it.  Color changes are applied and
+ * don't stop the fade.
+ */
+int
+fade_interrupted(void)
+{
+	XEvent e;
+
+	for (;;) {
+		/* a message from a signal handler leaves e untouched */
+		e.type = 0;
+		if (XPeekEventOrTimeout(dpy, &e, 1) == 0)
+			return 0;
+
+		if (exiting || force_dim || force_brighten)
+			return 1;
+
+		if (!gamma_event(&e)) {
 			DPRINTF(("%s: X event of type %d while stepping, "
 			    "breaking early\n", __func__, e.type));
-			return;
+			return 1;
 		}
+
+		XNextEvent(dpy, &e);
+		gamma_handle_event(&e);
+	}
+}
+
+/*
+ * Read the current backlight levels.  A level that changed since the hardware
+ * last reported it while we weren't dimmed was changed by the user, which
+ * becomes their offset from the ALS level or their new base level.
+ */
+static void
+channel_sync(struct channel *ch, float actual)
+{
+	if (actual < 0)
+		return;
+
+	if (ch->hw >= 0 && !dimmed && !LEVEL_EQ(actual, ch->hw)) {
+		DPRINTF(("%s: level changed from %0.2f to %0.2f\n", __func__,
+		    ch->hw, actual));
+		if (use_als)
+			ch->offset = actual - ch->base;
+		else
+			ch->base = actual;
+		ch->cur = actual;
+	} else if (ch->cur < 0) {
+		if (ch->base < 0)
+			ch->base = actual;
+		ch->cur = actual;
 	}
+
+	ch->hw = actual;
+}
+
+void
+channels_sync(void)
+{
+	/* levels are in flux and will be read back when the fade is done */
+	if (fading)
+		return;
+
+	if (dim_screen || use_als)
+		channel_sync(&screen, backlight_op(OP_GET, 0));
+	if (dim_kbd)
+		channel_sync(&kbd, kbd_backlight_op(OP_GET, 0));
+
+	/* a user change moves the screen's target */
+	state_publish();
 }
 
 float
@@ -507,6 +1004,18 @@ backlight_op(int op, float new_backlight)
 
 	float cur_backlight = -1.0;
 
+	if (op == OP_SET) {
+		if (new_backlight < quirk.min_level)
+			new_backlight = quirk.min_level;
+
+		backlight_ratelimit();
+	}
+
+	if (use_gamma)
+		return gamma_op(op, new_backlight);
+	if (use_overlay)
+		return overlay_op(op, new_backlight);
+
 	if (backlight_a == None) {
 #ifdef __OpenBSD__
 		struct wsdisplay_param param;
@@ -686,21 +1195,39 @@ als_find_sensor(void)
 	return 0;
 }
 
-void
+/* whether ALS_POLL_MSECS have passed since the als was last read */
+int
+als_due(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (((now.tv_sec - als_polled.tv_sec) * 1000) +
+	    ((now.tv_nsec - als_polled.tv_nsec) / 1000000) >= ALS_POLL_MSECS);
+}
+
+/*
+ * Read the ALS and update the base levels, returning 1 if the lux changed
+ * enough to warrant a fade
+ */
+int
 als_fetch(void)
 {
+	clock_gettime(CLOCK_MONOTONIC, &als_polled);
+
 #ifdef __OpenBSD__
 	struct sensordev sensordev;
 	struct sensor sensor;
 	size_t sdlen;
-	float lux, tbacklight = backlight, tkbd_backlight = kbd_backlight;
+	float lux;
 	int i;
 
 	sdlen = sizeof(sensordev);
 
 	if (sysctl(alsmib, 5, &sensor, &sdlen, NULL, 0) == -1) {
 		warn("sysctl");
-		return;
+		return 0;
 	}
 
 	lux = sensor.value / 1000000.0;
@@ -709,12 +1236,15 @@ als_fetch(void)
 		als = lux;
 	} else if (abs((int)lux - (int)als) < 10) {
 		als = lux;
-		return;
+		return 0;
 	} else {
 		DPRINTF(("als lux change %f -> %f, screen: %f, kbd: %f\n", als,
-		    lux, backlight, kbd_backlight));
+		    lux, screen.base, kbd.base));
 	}
 
+	/* pick up any changes the user made relative to the old level */
+	channels_sync();
+
 	for (i = (sizeof(als_settings) / sizeof(struct als_setting)) - 1;
 	    i >= 0; i--) {
 		struct als_setting as = als_settings[i];
@@ -724,83 +1254,1046 @@ als_fetch(void)
 
 		DPRINTF(("using lux profile %s\n", as.label));
 
-		if (dim_kbd && ((int)round(kbd_backlight) != as.kbd_backlight)) {
+		/* become our new normal, the next fade will apply it */
+		if (dim_kbd && ((int)round(kbd.base) != as.kbd_backlight)) {
 			DPRINTF(("als: adjusting keyboard backlight from %d%% "
-			    "to %d%%\n", (int)round(kbd_backlight),
+			    "to %d%%\n", (int)round(kbd.base),
 			    as.kbd_backlight));
-			tkbd_backlight = as.kbd_backlight;
+			kbd.base = as.kbd_backlight;
 		}
 
-		if ((int)round(backlight) != as.backlight) {
+		if ((int)round(screen.base) != as.backlight) {
 			DPRINTF(("als: adjusting screen backlight from %d%% "
-			    "to %d%%\n", (int)round(backlight), as.backlight));
-			tbacklight = as.backlight;
+			    "to %d%%\n", (int)round(screen.base),
+			    as.backlight));
+			screen.base = as.backlight;
 		}
 
-		if ((int)round(kbd_backlight) != tkbd_backlight ||
-		    (int)round(backlight) != tbacklight)
-			stepper(tbacklight, tkbd_backlight, dim_steps, 0);
-
-		/* become our new normal */
-		backlight = tbacklight;
-		kbd_backlight = tkbd_backlight;
-
 		setproctitle("%s", as.label);
 
 		break;
 	}
 
 	als = lux;
+
+	/* the screen's target may have changed */
+	state_publish();
+
+	return 1;
+#else
+	return 0;
 #endif
 }
 
+/*
+ * Charge the thread cpu time used since the last switch to the current
+ * subsystem and make sub the current one, returning the previous subsystem so
+ * callers can switch back.
+ */
+int
+acct_enter(int sub)
+{
+	struct acct_counter *ac = &acct_counters[acct_cur];
+	struct timespec now;
+	int prev = acct_cur;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	ac->cpu.tv_sec += now.tv_sec - acct_cpu_mark.tv_sec;
+	ac->cpu.tv_nsec += now.tv_nsec - acct_cpu_mark.tv_nsec;
+	if (ac->cpu.tv_nsec < 0) {
+		ac->cpu.tv_sec--;
+		ac->cpu.tv_nsec += 1000000000;
+	} else if (ac->cpu.tv_nsec >= 1000000000) {
+		ac->cpu.tv_sec++;
+		ac->cpu.tv_nsec -= 1000000000;
+	}
+
+	acct_cpu_mark = now;
+	acct_cur = sub;
+
+	return prev;
+}
+
 void
-usage(void)
+acct_wakeup(int sub)
 {
-	fprintf(stderr, "usage: %s [-adkn] [-b brighten steps] [-p dim pct] "
-	    "[-s dim steps] [-t timeout secs]\n", __progname);
-	exit(1);
+	acct_counters[sub].wakeups++;
 }
 
+/*
+ * Print wakeups and cpu time per subsystem, relative to the counters in since
+ * (if not NULL) and the time since start, along with our context switches
+ */
 void
-bail(int sig)
+acct_report(const char *label, struct acct_counter *since,
+    struct acct_state_counter *since_states, struct timespec *start,
+    long since_csw)
 {
-	int msg = MSG_EXIT;
+	struct acct_state_counter st;
+	struct timespec now;
+	struct rusage ru;
+	unsigned long wakeups, total_wakeups = 0;
+	double cpu, total_cpu = 0, mins;
+	long csw = 0;
+	int i;
 
-	if (exiting)
-		exit(0);
+	acct_enter(acct_cur);
 
-	/*
-	 * Doing X ops inside a signal handler causes an infinite loop in
-	 * _XReply/xcb, so we can't properly brighten and exit ourselves.
-	 * write to the pipe setup earlier so our event loop will see it upon
-	 * polling.
-	 */
-	DPRINTF(("got signal %d, trying to exit\n", sig));
-	write(pipemsg[1], &msg, 1);
-	exiting = 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	mins = ((now.tv_sec - start->tv_sec) +
+	    ((now.tv_nsec - start->tv_nsec) / 1000000000.0)) / 60.0;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		csw = ru.ru_nvcsw + ru.ru_nivcsw;
+
+	printf("accounting (%s) over %0.1f min:\n", label, mins);
+
+	for (i = 0; i < ACCT_MAX; i++) {
+		wakeups = acct_counters[i].wakeups;
+		cpu = (acct_counters[i].cpu.tv_sec * 1000.0) +
+		    (acct_counters[i].cpu.tv_nsec / 1000000.0);
+
+		if (since) {
+			wakeups -= since[i].wakeups;
+			cpu -= (since[i].cpu.tv_sec * 1000.0) +
+			    (since[i].cpu.tv_nsec / 1000000.0);
+		}
+
+		printf("  %-10s %8lu wakeups %10.2f ms cpu\n", acct_names[i],
+		    wakeups, cpu);
+
+		total_wakeups += wakeups;
+		total_cpu += cpu;
+	}
+
+	printf("  %-10s %8lu wakeups %10.2f ms cpu, %0.2f wakeups/min, "
+	    "%ld context switches\n", "all", total_wakeups, total_cpu,
+	    (mins > 0 ? total_wakeups / mins : 0), csw - since_csw);
+
+	/* charge the current period without changing state */
+	acct_state(acct_state_cur);
+
+	for (i = 0; i < 2; i++) {
+		st = acct_states[i];
+		if (since_states) {
+			st.secs -= since_states[i].secs;
+			st.busy -= since_states[i].busy;
+			st.total -= since_states[i].total;
+		}
+
+		if (st.secs == 0)
+			continue;
+
+		printf("  %-10s %8.1f min, system cpu %0.1f%% busy\n",
+		    (i ? "dimmed" : "bright"), st.secs / 60.0,
+		    st.total ? ((st.busy * 100.0) / st.total) : 0);
+	}
+
+	fflush(stdout);
 }
 
-void
-sigusr1(int sig)
+/* read the system-wide busy and total cpu time, in clock ticks */
+static int
+acct_system_cpu(unsigned long long *busy, unsigned long long *total)
 {
-	int msg = MSG_DIM;
+#ifdef __OpenBSD__
+	int mib[2] = { CTL_KERN, KERN_CPTIME };
+	long cp_time[CPUSTATES];
+	size_t len = sizeof(cp_time);
+	int i;
 
-	DPRINTF(("got signal %d, forcing dim\n", sig));
-	write(pipemsg[1], &msg, 1);
+	if (sysctl(mib, 2, &cp_time, &len, NULL, 0) == -1)
+		return 0;
+
+	*total = 0;
+	for (i = 0; i < CPUSTATES; i++)
+		*total += cp_time[i];
+	*busy = *total - cp_time[CP_IDLE];
+
+	return 1;
+#else
+	unsigned long long v[8] = { 0 };
+	FILE *fp;
+	int i, n;
+
+	if (!(fp = fopen("/proc/stat", "r")))
+		return 0;
+
+	/* user nice system idle iowait irq softirq steal */
+	n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+	    &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(fp);
+	if (n < 4)
+		return 0;
+
+	*total = 0;
+	for (i = 0; i < 8; i++)
+		*total += v[i];
+	*busy = *total - v[3] - v[4];
+
+	return 1;
+#endif
 }
 
+/*
+ * Charge the wall time and system cpu usage since the last call to the state
+ * we were in, then switch to state d (0 for bright, 1 for dimmed).  This is
+ * only sampled on state changes and reports, not periodically.
+ */
 void
-sigusr2(int sig)
+acct_state(int d)
 {
-	int msg = MSG_BRIGHTEN;
+	struct timespec now;
+	unsigned long long busy, total;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (acct_state_since.tv_sec)
+		acct_states[acct_state_cur].secs +=
+		    (now.tv_sec - acct_state_since.tv_sec) +
+		    ((now.tv_nsec - acct_state_since.tv_nsec) / 1000000000.0);
+
+	if (acct_system_cpu(&busy, &total)) {
+		if (acct_state_total) {
+			acct_states[acct_state_cur].busy +=
+			    busy - acct_state_busy;
+			acct_states[acct_state_cur].total +=
+			    total - acct_state_total;
+		}
+		acct_state_busy = busy;
+		acct_state_total = total;
+	}
 
-	DPRINTF(("got signal %d, forcing brighten\n", sig));
-	write(pipemsg[1], &msg, 1);
+	acct_state_since = now;
+	acct_state_cur = d;
 }
 
-int
-XPeekEventOrTimeout(Display *dpy, XEvent *e, unsigned int msecs)
+/*
+ * When debugging, summarize the last period's accounting.  This is only
+ * checked when we're already awake so it never causes a wakeup of its own.
+ */
+void
+acct_summary(void)
+{
+	struct timespec now;
+	struct rusage ru;
+
+	if (!debug)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - acct_last_summary.tv_sec < ACCT_SUMMARY_SECS)
+		return;
+
+	acct_report("last period", acct_last, acct_states_last,
+	    &acct_last_summary, acct_last_csw);
+
+	memcpy(acct_last, acct_counters, sizeof(acct_last));
+	memcpy(acct_states_last, acct_states, sizeof(acct_states_last));
+	acct_last_summary = now;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		acct_last_csw = ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/*
+ * Map the idle histogram in file, creating it if we're recording.  Anything
+ * that isn't an idle histogram is refused before it's written to.
+ */
+void
+hist_open(const char *file, int readonly)
+{
+	struct stat sb;
+	int fd;
+
+	if (readonly)
+		fd = open(file, O_RDONLY);
+	else
+		fd = open(file, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		err(1, "%s", file);
+
+	if (fstat(fd, &sb) == -1)
+		err(1, "%s", file);
+
+	if (sb.st_size == 0 && !readonly) {
+		if (ftruncate(fd, sizeof(struct idle_hist)) == -1)
+			err(1, "%s", file);
+	} else if (sb.st_size != sizeof(struct idle_hist))
+		errx(1, "%s: not an idle histogram file", file);
+
+	hist = mmap(NULL, sizeof(struct idle_hist),
+	    PROT_READ | (readonly ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+	if (hist == MAP_FAILED)
+		err(1, "mmap %s", file);
+
+	close(fd);
+
+	if (sb.st_size == 0 && !readonly)
+		hist->magic = HIST_MAGIC;
+	else if (hist->magic != HIST_MAGIC)
+		errx(1, "%s: not an idle histogram file", file);
+
+	if (!readonly)
+		DPRINTF(("recording idle histogram to %s\n", file));
+}
+
+static int
+hist_bucket(uint64_t secs)
+{
+	int b = 0;
+
+	while (secs > 0 && b < HIST_BUCKETS - 1) {
+		secs >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+/*
+ * Record an idle period that reached timeout seconds, dimmed, and then ended
+ * away seconds later when the user returned.
+ */
+void
+hist_record(uint64_t timeout, uint64_t away)
+{
+	int b;
+
+	DPRINTF(("user returned %llu sec%s after dimming\n",
+	    (unsigned long long)away, (away == 1 ? "" : "s")));
+
+	if (hist->min_timeout == 0 || timeout < hist->min_timeout)
+		hist->min_timeout = timeout;
+
+	b = hist_bucket(timeout + away);
+	hist->idle_count[b]++;
+	hist->idle_secs[b] += timeout + away;
+
+	b = hist_bucket(away);
+	hist->return_count[b]++;
+	hist->return_secs[b] += away;
+
+	msync(hist, sizeof(struct idle_hist), MS_ASYNC);
+}
+
+void
+hist_report(void)
+{
+	uint64_t dims = 0, false_alarms = 0, dimmed_secs = 0;
+	uint64_t avoided, alarms;
+	double mean, saved;
+	int64_t t, alt;
+	int i, j;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dims += hist->return_count[i];
+		dimmed_secs += hist->return_secs[i];
+
+		if ((1ULL << i) <= HIST_FALSE_ALARM_SECS)
+			false_alarms += hist->return_count[i];
+	}
+
+	if (dims == 0) {
+		printf("no idle periods recorded\n");
+		return;
+	}
+
+	t = hist->min_timeout;
+
+	printf("%llu dims with a timeout of at least %lld secs, %llu secs "
+	    "dimmed\n", (unsigned long long)dims, (long long)t,
+	    (unsigned long long)dimmed_secs);
+	printf("%llu (%0.1f%%) were false alarms, the user returning within "
+	    "%d secs\n", (unsigned long long)false_alarms,
+	    (false_alarms * 100.0) / dims, HIST_FALSE_ALARM_SECS);
+
+	printf("\nuser returned after dimming:\n");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist->return_count[i])
+			continue;
+
+		/* the last bucket holds everything longer */
+		if (i == HIST_BUCKETS - 1)
+			printf("  %8llu or more secs: %llu\n",
+			    1ULL << (i - 1),
+			    (unsigned long long)hist->return_count[i]);
+		else
+			printf("  %8llu - %8llu secs: %llu\n",
+			    (i == 0 ? 0ULL : (1ULL << (i - 1))),
+			    (1ULL << i) - 1,
+			    (unsigned long long)hist->return_count[i]);
+	}
+
+	/*
+	 * Estimate what other timeouts would have done, assuming every period
+	 * in a bucket lasted that bucket's mean.  Idle periods shorter than the
+	 * recorded timeout were never seen, so shorter timeouts only get a
+	 * lower bound.
+	 */
+	printf("\n%10s %10s %12s %12s\n", "timeout", "dims", "false alarms",
+	    "secs saved");
+
+	for (alt = (t / 4 > 0 ? t / 4 : 1); alt <= t * 4; alt *= 2) {
+		if (alt == t) {
+			printf("%10lld %10llu %12llu %12d\n", (long long)alt,
+			    (unsigned long long)dims,
+			    (unsigned long long)false_alarms, 0);
+			continue;
+		} else if (alt < t) {
+			printf("%10lld %9llu+ %12s %11lld+\n", (long long)alt,
+			    (unsigned long long)dims, "?",
+			    (long long)(dims * (t - alt)));
+			continue;
+		}
+
+		avoided = alarms = 0;
+		saved = 0;
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			if (!hist->idle_count[j])
+				continue;
+
+			mean = (double)hist->idle_secs[j] / hist->idle_count[j];
+			if (mean < alt)
+				avoided += hist->idle_count[j];
+			else {
+				saved += (mean - alt) * hist->idle_count[j];
+				if (mean - alt < HIST_FALSE_ALARM_SECS)
+					alarms += hist->idle_count[j];
+			}
+		}
+
+		/* negative: dimmed time lost by waiting longer */
+		printf("%10lld %10llu %12llu %12lld\n", (long long)alt,
+		    (unsigned long long)(dims - avoided),
+		    (unsigned long long)alarms,
+		    (long long)(saved - dimmed_secs));
+	}
+}
+
+/*
+ * Find the EDID of the panel we're controlling and build a key from its PNP
+ * manufacturer id and product code, like "edid:AUO:313d"
+ */
+static int
+quirks_edid_key(char *key, size_t len)
+{
+	XRRScreenResources *screen_res;
+	Atom edid_a, actual_type;
+	int actual_format, i, found = 0;
+	unsigned long nitems, bytes_after;
+	unsigned char *prop;
+	unsigned int mfg;
+
+	edid_a = XInternAtom(dpy, RR_PROPERTY_RANDR_EDID, True);
+	if (edid_a == None)
+		return 0;
+
+	screen_res = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+	if (!screen_res)
+		return 0;
+
+	for (i = 0; i < screen_res->noutput && !found; i++) {
+		RROutput output = screen_res->outputs[i];
+
+		/* prefer the output with the backlight, if we have one */
+		if (backlight_a != None) {
+			if (XRRGetOutputProperty(dpy, output, backlight_a,
+			    0, 4, False, False, None, &actual_type,
+			    &actual_format, &nitems, &bytes_after,
+			    &prop) != Success)
+				continue;
+			XFree(prop);
+			if (nitems == 0)
+				continue;
+		}
+
+		if (XRRGetOutputProperty(dpy, output, edid_a, 0, 32, False,
+		    False, AnyPropertyType, &actual_type, &actual_format,
+		    &nitems, &bytes_after, &prop) != Success)
+			continue;
+
+		if (actual_format == 8 && nitems >= 12) {
+			mfg = (prop[8] << 8) | prop[9];
+			snprintf(key, len, "edid:%c%c%c:%04x",
+			    'A' + ((mfg >> 10) & 0x1f) - 1,
+			    'A' + ((mfg >> 5) & 0x1f) - 1,
+			    'A' + (mfg & 0x1f) - 1,
+			    prop[10] | (prop[11] << 8));
+			found = 1;
+		}
+
+		XFree(prop);
+	}
+
+	XRRFreeScreenResources(screen_res);
+
+	return found;
+}
+
+/* build a key from the system vendor and product, like "dmi:LENOVO:20KH" */
+static int
+quirks_dmi_key(char *key, size_t len)
+{
+	char vendor[64], product[64];
+#ifdef __OpenBSD__
+	int mib[2] = { CTL_HW, 0 };
+	size_t vlen = sizeof(vendor), plen = sizeof(product);
+
+	mib[1] = HW_VENDOR;
+	if (sysctl(mib, 2, vendor, &vlen, NULL, 0) == -1)
+		return 0;
+	mib[1] = HW_PRODUCT;
+	if (sysctl(mib, 2, product, &plen, NULL, 0) == -1)
+		return 0;
+#else
+	FILE *fp;
+
+	if (!(fp = fopen("/sys/class/dmi/id/sys_vendor", "r")))
+		return 0;
+	if (!fgets(vendor, sizeof(vendor), fp))
+		vendor[0] = '\0';
+	fclose(fp);
+
+	if (!(fp = fopen("/sys/class/dmi/id/product_name", "r")))
+		return 0;
+	if (!fgets(product, sizeof(product), fp))
+		product[0] = '\0';
+	fclose(fp);
+
+	vendor[strcspn(vendor, "\n")] = '\0';
+	product[strcspn(product, "\n")] = '\0';
+#endif
+
+	if (vendor[0] == '\0' || product[0] == '\0')
+		return 0;
+
+	snprintf(key, len, "dmi:%s:%s", vendor, product);
+	return 1;
+}
+
+/*
+ * Read the quirks file once at startup and apply the entry matching this
+ * machine's panel (by EDID) or, failing that, the machine itself (by DMI).
+ * Each line is "min-level write-interval curve key", e.g.:
+ *
+ *	5	30	linear	dmi:LENOVO:20KHCTO1WW
+ */
+void
+quirks_load(const char *file)
+{
+	FILE *fp;
+	char edid_key[32], dmi_key[160];
+	char *line = NULL, *key;
+	char curve[16];
+	size_t linesize = 0;
+	int have_edid, have_dmi, matched = 0;
+	int min_level, interval, n, lineno = 0;
+
+	if (!(fp = fopen(file, "r")))
+		return;
+
+	have_edid = quirks_edid_key(edid_key, sizeof(edid_key));
+	have_dmi = quirks_dmi_key(dmi_key, sizeof(dmi_key));
+
+	if (have_edid)
+		DPRINTF(("%s: panel is %s\n", __func__, edid_key));
+	if (have_dmi)
+		DPRINTF(("%s: system is %s\n", __func__, dmi_key));
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[strspn(line, " \t")] == '\0')
+			continue;
+
+		if (sscanf(line, "%d %d %15s %n", &min_level, &interval, curve,
+		    &n) != 3 || min_level < 0 || min_level > 100 ||
+		    interval < 0) {
+			warnx("%s:%d: malformed quirk", file, lineno);
+			continue;
+		}
+		key = line + n;
+
+		/* an edid match is more specific, so it wins */
+		if (have_edid && strcmp(key, edid_key) == 0)
+			matched = 2;
+		else if (have_dmi && matched < 2 && strcmp(key, dmi_key) == 0)
+			matched = 1;
+		else
+			continue;
+
+		quirk.min_level = min_level;
+		quirk.write_interval = interval;
+		if (strcmp(curve, "log") == 0)
+			quirk.curve = CURVE_LOG;
+		else if (strcmp(curve, "linear") == 0)
+			quirk.curve = CURVE_LINEAR;
+		else
+			warnx("%s:%d: unknown curve %s", file, lineno, curve);
+
+		DPRINTF(("%s: using quirk for %s: min %d%%, %dms between "
+		    "writes, %s curve\n", __func__, key, quirk.min_level,
+		    quirk.write_interval, curve));
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/* wait until the quirk's minimum interval has passed since the last write */
+void
+backlight_ratelimit(void)
+{
+	static struct timespec last_write;
+	struct timespec now;
+	long elapsed;
+
+	if (!quirk.write_interval)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ((now.tv_sec - last_write.tv_sec) * 1000) +
+	    ((now.tv_nsec - last_write.tv_nsec) / 1000000);
+
+	if (elapsed >= 0 && elapsed < quirk.write_interval) {
+		usleep((quirk.write_interval - elapsed) * 1000);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	last_write = now;
+}
+
+void
+gamma_init(void)
+{
+	int rr_error;
+
+	gamma_selection_a = XInternAtom(dpy, "_XDIMMER", False);
+	gamma_color_a = XInternAtom(dpy, "_XDIMMER_COLOR", False);
+
+	if (XGetSelectionOwner(dpy, gamma_selection_a) != None)
+		errx(1, "another xdimmer is already managing gamma");
+
+	gamma_win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), -1, -1,
+	    1, 1, 0, 0, 0);
+	XSelectInput(dpy, gamma_win, PropertyChangeMask);
+	XSetSelectionOwner(dpy, gamma_selection_a, gamma_win, CurrentTime);
+	/* SelectionClear is always delivered to the owner, no mask needed */
+	if (XGetSelectionOwner(dpy, gamma_selection_a) != gamma_win)
+		errx(1, "couldn't take ownership of gamma");
+
+	DPRINTF(("%s: managing gamma with window 0x%lx\n", __func__,
+	    gamma_win));
+
+	if (XRRQueryExtension(dpy, &gamma_rr_event, &rr_error) != True)
+		errx(1, "no randr extension available");
+	XRRSelectInput(dpy, DefaultRootWindow(dpy), RRScreenChangeNotifyMask);
+
+	gamma_load_crtcs();
+	gamma_fetch_color();
+	gamma_apply();
+}
+
+/*
+ * Find each crtc's gamma size and allocate a ramp for it once, so fade steps
+ * only have to fill and write them
+ */
+void
+gamma_load_crtcs(void)
+{
+	XRRScreenResources *screen_res;
+	int i, j, size;
+
+	for (i = 0; i < ngamma_crtcs; i++)
+		XRRFreeGamma(gamma_ramps[i]);
+	ngamma_crtcs = 0;
+
+	screen_res = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+	if (!screen_res)
+		errx(1, "no screen resources");
+
+	gamma_crtcs = reallocarray(gamma_crtcs, screen_res->ncrtc,
+	    sizeof(RRCrtc));
+	gamma_ramps = reallocarray(gamma_ramps, screen_res->ncrtc,
+	    sizeof(XRRCrtcGamma *));
+	if (screen_res->ncrtc && (!gamma_crtcs || !gamma_ramps))
+		err(1, "reallocarray");
+
+	for (i = 0; i < screen_res->ncrtc; i++) {
+		size = XRRGetCrtcGammaSize(dpy, screen_res->crtcs[i]);
+		if (size < 2)
+			continue;
+
+		if (!(gamma_ramps[ngamma_crtcs] = XRRAllocGamma(size)))
+			continue;
+
+		gamma_crtcs[ngamma_crtcs++] = screen_res->crtcs[i];
+
+		for (j = 0; j < ngamma_saved; j++)
+			if (gamma_saved_crtcs[j] == screen_res->crtcs[i])
+				break;
+		if (j < ngamma_saved)
+			continue;
+
+		gamma_saved_crtcs = reallocarray(gamma_saved_crtcs,
+		    ngamma_saved + 1, sizeof(RRCrtc));
+		gamma_saved = reallocarray(gamma_saved, ngamma_saved + 1,
+		    sizeof(XRRCrtcGamma *));
+		if (!gamma_saved_crtcs || !gamma_saved)
+			err(1, "reallocarray");
+
+		if (!(gamma_saved[ngamma_saved] = XRRGetCrtcGamma(dpy,
+		    screen_res->crtcs[i])))
+			continue;
+		gamma_saved_crtcs[ngamma_saved++] = screen_res->crtcs[i];
+	}
+
+	XRRFreeScreenResources(screen_res);
+
+	DPRINTF(("%s: %d crtc%s with gamma\n", __func__, ngamma_crtcs,
+	    (ngamma_crtcs == 1 ? "" : "s")));
+
+	/* new crtcs need their ramps written */
+	gamma_written[0] = gamma_written[1] = gamma_written[2] = -1;
+}
+
+float
+gamma_op(int op, float new_backlight)
+{
+	if (op == OP_SET) {
+		DPRINTF(("%s: set %f\n", __func__, new_backlight));
+
+		gamma_level = new_backlight;
+		if (gamma_level > 100)
+			gamma_level = 100;
+		else if (gamma_level < 0)
+			gamma_level = 0;
+
+		gamma_apply();
+	}
+
+	return gamma_level;
+}
+
+void
+gamma_fetch_color(void)
+{
+	Atom actual_type;
+	int actual_format, i;
+	unsigned long nitems, bytes_after;
+	unsigned char *prop;
+
+	for (i = 0; i < 3; i++)
+		gamma_color[i] = 1.0;
+
+	if (XGetWindowProperty(dpy, gamma_win, gamma_color_a, 0, 3, False,
+	    XA_CARDINAL, &actual_type, &actual_format, &nitems, &bytes_after,
+	    &prop) != Success)
+		return;
+
+	if (actual_type == XA_CARDINAL && actual_format == 32 && nitems == 3) {
+		for (i = 0; i < 3; i++) {
+			gamma_color[i] = ((long *)prop)[i] / 1000.0;
+			if (gamma_color[i] > 1.0)
+				gamma_color[i] = 1.0;
+		}
+	}
+
+	XFree(prop);
+
+	DPRINTF(("%s: color multipliers %0.3f %0.3f %0.3f\n", __func__,
+	    gamma_color[0], gamma_color[1], gamma_color[2]));
+}
+
+/* whether e is a color change or screen change we need to handle */
+int
+gamma_event(XEvent *e)
+{
+	if (!use_gamma)
+		return 0;
+
+	if (e->type == PropertyNotify && e->xproperty.window == gamma_win &&
+	    e->xproperty.atom == gamma_color_a)
+		return 1;
+
+	if (e->type == gamma_rr_event + RRScreenChangeNotify)
+		return 1;
+
+	if (e->type == SelectionClear && e->xselectionclear.window == gamma_win)
+		return 1;
+
+	return 0;
+}
+
+void
+gamma_handle_event(XEvent *e)
+{
+	if (e->type == SelectionClear) {
+		/*
+		 * Another client took over gamma, so stop writing ramps before
+		 * we fight over them, and exit without restoring ours.
+		 */
+		warnx("lost the _XDIMMER selection, exiting");
+		gamma_lost = 1;
+		exiting = 1;
+		return;
+	}
+
+	if (gamma_lost)
+		return;
+
+	if (e->type == PropertyNotify) {
+		gamma_fetch_color();
+	} else {
+		XRRUpdateConfiguration(e);
+		gamma_load_crtcs();
+	}
+
+	gamma_apply();
+}
+
+/*
+ * Compose the dim level with the color multipliers and write one ramp to each
+ * crtc, but only if the result has changed since the last write
+ */
+void
+gamma_apply(void)
+{
+	XRRCrtcGamma *ramp;
+	float mult[3];
+	int i, j;
+
+	if (gamma_lost)
+		return;
+
+	for (i = 0; i < 3; i++)
+		mult[i] = (gamma_level / 100.0) * gamma_color[i];
+
+	if (memcmp(mult, gamma_written, sizeof(mult)) == 0)
+		return;
+
+	for (i = 0; i < ngamma_crtcs; i++) {
+		ramp = gamma_ramps[i];
+
+		for (j = 0; j < ramp->size; j++) {
+			float v = (65535.0 * j) / (ramp->size - 1);
+
+			ramp->red[j] = v * mult[0];
+			ramp->green[j] = v * mult[1];
+			ramp->blue[j] = v * mult[2];
+		}
+
+		XRRSetCrtcGamma(dpy, gamma_crtcs[i], ramp);
+	}
+
+	XFlush(dpy);
+
+	memcpy(gamma_written, mult, sizeof(gamma_written));
+}
+
+/* put back the ramps crtcs had before we started writing them */
+void
+gamma_restore(void)
+{
+	int i, j;
+
+	if (gamma_lost)
+		return;
+
+	for (i = 0; i < ngamma_crtcs; i++) {
+		for (j = 0; j < ngamma_saved; j++) {
+			if (gamma_saved_crtcs[j] != gamma_crtcs[i])
+				continue;
+
+			if (gamma_saved[j]->size == gamma_ramps[i]->size)
+				XRRSetCrtcGamma(dpy, gamma_crtcs[i],
+				    gamma_saved[j]);
+			break;
+		}
+	}
+
+	XFlush(dpy);
+}
+
+float
+overlay_op(int op, float new_backlight)
+{
+	unsigned long opacity;
+	int i;
+
+	if (op != OP_SET)
+		return overlay_level;
+
+	DPRINTF(("%s: set %f\n", __func__, new_backlight));
+
+	if (new_backlight > 100)
+		new_backlight = 100;
+	else if (new_backlight < 0)
+		new_backlight = 0;
+	overlay_level = new_backlight;
+
+	if (overlay_level >= 100) {
+		/* nothing to blend, don't make the compositor do it */
+		for (i = 0; i < noverlay_wins; i++)
+			XUnmapWindow(dpy, overlay_wins[i]);
+		overlay_mapped = 0;
+		overlay_no_cm = 0;
+		XFlush(dpy);
+		return overlay_level;
+	}
+
+	if (!overlay_mapped) {
+		/*
+		 * without a compositor, our windows would just be opaque
+		 * black, so don't show them at all.  checking costs a round
+		 * trip, so only do it once until we're brightened again.
+		 */
+		if (overlay_no_cm)
+			return overlay_level;
+		if (XGetSelectionOwner(dpy, overlay_cm_a) == None) {
+			DPRINTF(("%s: no compositor running, not dimming\n",
+			    __func__));
+			overlay_no_cm = 1;
+			return overlay_level;
+		}
+
+		/* outputs may have changed since we last dimmed */
+		overlay_layout();
+	}
+
+	opacity = (1.0 - (overlay_level / 100.0)) * 0xffffffff;
+
+	for (i = 0; i < noverlay_wins; i++)
+		XChangeProperty(dpy, overlay_wins[i], overlay_opacity_a,
+		    XA_CARDINAL, 32, PropModeReplace,
+		    (unsigned char *)&opacity, 1);
+
+	if (!overlay_mapped) {
+		for (i = 0; i < noverlay_wins; i++)
+			XMapRaised(dpy, overlay_wins[i]);
+		overlay_mapped = 1;
+	} else {
+		/* stay above override-redirect windows mapped since */
+		for (i = 0; i < noverlay_wins; i++)
+			XRaiseWindow(dpy, overlay_wins[i]);
+	}
+
+	XFlush(dpy);
+
+	return overlay_level;
+}
+
+/* (re)create an input-transparent black window covering each active crtc */
+void
+overlay_layout(void)
+{
+	XRRScreenResources *screen_res;
+	XRRCrtcInfo *crtc_info;
+	XSetWindowAttributes attrs;
+	Window win;
+	int i;
+
+	for (i = 0; i < noverlay_wins; i++)
+		XDestroyWindow(dpy, overlay_wins[i]);
+	noverlay_wins = 0;
+
+	screen_res = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+	if (!screen_res)
+		errx(1, "no screen resources");
+
+	attrs.override_redirect = True;
+	attrs.background_pixel = BlackPixel(dpy, DefaultScreen(dpy));
+
+	for (i = 0; i < screen_res->ncrtc && noverlay_wins < MAX_OVERLAYS;
+	    i++) {
+		crtc_info = XRRGetCrtcInfo(dpy, screen_res,
+		    screen_res->crtcs[i]);
+		if (!crtc_info)
+			continue;
+
+		if (crtc_info->mode == None || crtc_info->noutput == 0) {
+			XRRFreeCrtcInfo(crtc_info);
+			continue;
+		}
+
+		win = XCreateWindow(dpy, DefaultRootWindow(dpy), crtc_info->x,
+		    crtc_info->y, crtc_info->width, crtc_info->height, 0,
+		    CopyFromParent, InputOutput, CopyFromParent,
+		    CWOverrideRedirect | CWBackPixel, &attrs);
+
+		/* an empty input shape lets all input through to below */
+		XShapeCombineRectangles(dpy, win, ShapeInput, 0, 0, NULL, 0,
+		    ShapeSet, Unsorted);
+
+		DPRINTF(("%s: overlay 0x%lx at %dx%d+%d+%d\n", __func__, win,
+		    crtc_info->width, crtc_info->height, crtc_info->x,
+		    crtc_info->y));
+
+		overlay_wins[noverlay_wins++] = win;
+		XRRFreeCrtcInfo(crtc_info);
+	}
+
+	XRRFreeScreenResources(screen_res);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-adgkKnoq] [-b brighten steps] "
+	    "[-H histogram file] [-p dim pct] [-s dim steps] "
+	    "[-t timeout secs] [-x state command]\n", __progname);
+	exit(1);
+}
+
+void
+bail(int sig)
+{
+	int msg = MSG_EXIT;
+
+	if (exiting)
+		exit(0);
+
+	/*
+	 * Doing X ops inside a signal handler causes an infinite loop in
+	 * _XReply/xcb, so we can't properly brighten and exit ourselves.
+	 * write to the pipe setup earlier so our event loop will see it upon
+	 * polling.
+	 */
+	DPRINTF(("got signal %d, trying to exit\n", sig));
+	write(pipemsg[1], &msg, 1);
+	exiting = 1;
+}
+
+void
+sigusr1(int sig)
+{
+	int msg = MSG_DIM;
+
+	DPRINTF(("got signal %d, forcing dim\n", sig));
+	write(pipemsg[1], &msg, 1);
+}
+
+void
+sigusr2(int sig)
+{
+	int msg = MSG_BRIGHTEN;
+
+	DPRINTF(("got signal %d, forcing brighten\n", sig));
+	write(pipemsg[1], &msg, 1);
+}
+
+void
+sighup(int sig)
+{
+	int msg = MSG_STATS;
+
+	write(pipemsg[1], &msg, 1);
+}
+
+int
+XPeekEventOrTimeout(Display *dpy, XEvent *e, unsigned int msecs)
 {
 	struct pollfd pfd[2];
 	int msg = 0;
@@ -818,10 +2311,16 @@ XPeekEventOrTimeout(Display *dpy, XEvent *e, unsigned int msecs)
 			DPRINTF(("poll returned -1 for errno %d\n", errno));
 			break;
 		case 0:
-			/* timed out */
+			/*
+			 * timed out, which is a step of a fade or otherwise
+			 * the als polling interval
+			 */
+			acct_wakeup(acct_cur == ACCT_FADE ? ACCT_FADE :
+			    ACCT_ALS);
 			return 0;
 		default:
 			if (pfd[1].revents) {
+				acct_wakeup(ACCT_SIGNAL);
 				read(pipemsg[0], &msg, 1);
 				switch (msg) {
 				case MSG_EXIT:
@@ -839,12 +2338,18 @@ XPeekEventOrTimeout(Display *dpy, XEvent *e, unsigned int msecs)
 					    "brighten\n", __func__));
 					force_brighten = 1;
 					break;
+				case MSG_STATS:
+					acct_report("total", NULL, NULL,
+					    &acct_start, 0);
+					/* not an event, keep waiting */
+					continue;
 				default:
 					DPRINTF(("%s: junk on msg pipe: 0x%x\n",
 					    __func__, msg));
 				}
 				return 1;
 			} else if (pfd[0].revents) {
+				acct_wakeup(ACCT_X);
 				DPRINTF(("%s: got X event\n", __func__));
 				XPeekEvent(dpy, e);
 				return 1;
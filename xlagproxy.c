@@ -0,0 +1,719 @@
+/*
+ * xlagproxy
+ * Copyright (c) 2026 joshua stein <jcs@jcs.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A tiny X11 protocol proxy for testing xdimmer against slow or remote X
+ * servers.  It listens on a local display socket, forwards everything to
+ * another local display (usually an Xvfb), delays each chunk of client
+ * requests by a configurable latency plus random jitter, and counts requests
+ * by major/minor opcode and replies received.
+ *
+ *	Xvfb :1 &
+ *	xlagproxy -l 20 -j 5 :9 :1 &
+ *	DISPLAY=:9 xdimmer -d
+ *
+ * SIGUSR1 prints and resets the counters, so the number of round trips of a
+ * single dim or brighten can be measured.  SIGINT/SIGTERM print them and exit.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef __linux__
+#include <bsd/stdlib.h>
+#else
+#include <stdlib.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define X11_SOCKET_DIR	"/tmp/.X11-unix"
+#define X11_LOCK_FMT	"/tmp/.X%d-lock"
+#define MAX_CONNS	16
+#define CHUNK_SIZE	4096
+
+struct chunk {
+	struct chunk *next;
+	struct timespec due;
+	size_t len;
+	size_t off;
+	unsigned char buf[CHUNK_SIZE];
+};
+
+/* incremental parser for one direction of an X11 byte stream */
+struct xstream {
+	int setup_done;
+	int msb;
+	unsigned char hdr[32];
+	size_t hdrlen;
+	size_t skip;
+};
+
+struct conn {
+	int cfd;
+	int sfd;
+	struct chunk *head;
+	struct chunk *tail;
+	struct xstream req;
+	struct xstream rep;
+};
+
+void proxy_loop(int);
+void conn_accept(int);
+void conn_close(struct conn *);
+int conn_flush(struct conn *, struct timespec *);
+int conn_from_client(struct conn *, struct timespec *);
+int conn_from_server(struct conn *);
+void parse_requests(struct xstream *, const unsigned char *, size_t);
+void parse_replies(struct xstream *, const unsigned char *, size_t);
+int display_socket(const char *, struct sockaddr_un *, int *);
+void display_lock(int);
+int writeall(int, const unsigned char *, size_t);
+long ts_diff_ms(struct timespec *, struct timespec *);
+void ts_add_ms(struct timespec *, long);
+void report(void);
+void sighandler(int);
+void usage(void);
+
+extern char *__progname;
+
+static struct conn conns[MAX_CONNS];
+static struct sockaddr_un upstream;
+static struct sockaddr_un listener;
+static char lockfile[PATH_MAX];
+
+static int latency = 0;
+static int jitter = 0;
+static int debug = 0;
+#define DPRINTF(x) { if (debug) { printf x; } };
+
+static volatile sig_atomic_t got_report = 0;
+static volatile sig_atomic_t got_exit = 0;
+
+/* counters */
+static unsigned long core_reqs[128];
+static unsigned long ext_reqs[128][256];
+static unsigned long nreqs = 0;
+static unsigned long nreplies = 0;
+static unsigned long req_bytes = 0;
+
+int
+main(int argc, char *argv[])
+{
+	int ch, lfd, sfd, num;
+
+	while ((ch = getopt(argc, argv, "dj:l:")) != -1) {
+		const char *errstr;
+
+		switch (ch) {
+		case 'd':
+			debug = 1;
+			break;
+		case 'j':
+			jitter = strtonum(optarg, 0, 10000, &errstr);
+			if (errstr)
+				errx(2, "jitter: %s", errstr);
+			break;
+		case 'l':
+			latency = strtonum(optarg, 0, 10000, &errstr);
+			if (errstr)
+				errx(2, "latency: %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage();
+
+	if (display_socket(argv[0], &listener, &num) == -1)
+		errx(1, "bad listen display %s", argv[0]);
+	if (display_socket(argv[1], &upstream, NULL) == -1)
+		errx(1, "bad upstream display %s", argv[1]);
+	if (strcmp(listener.sun_path, upstream.sun_path) == 0)
+		errx(1, "listen and upstream displays are the same");
+
+	/* claim the display like an X server would */
+	display_lock(num);
+
+	/* only remove a stale socket, never one that something answers on */
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(sfd, (struct sockaddr *)&listener,
+	    sizeof(listener)) == 0) {
+		unlink(lockfile);
+		errx(1, "%s is in use by a running X server", argv[0]);
+	}
+	close(sfd);
+
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+
+	unlink(listener.sun_path);
+	if (bind(lfd, (struct sockaddr *)&listener, sizeof(listener)) == -1)
+		err(1, "bind %s", listener.sun_path);
+	if (listen(lfd, 5) == -1)
+		err(1, "listen");
+
+	DPRINTF(("proxying %s to %s, latency %dms, jitter %dms\n",
+	    listener.sun_path, upstream.sun_path, latency, jitter));
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGUSR1, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	proxy_loop(lfd);
+
+	report();
+	close(lfd);
+	unlink(listener.sun_path);
+	unlink(lockfile);
+
+	return 0;
+}
+
+void
+proxy_loop(int lfd)
+{
+	struct pollfd pfd[1 + (MAX_CONNS * 2)];
+	struct timespec now, next;
+	int i, n, timeout;
+
+	for (i = 0; i < MAX_CONNS; i++)
+		conns[i].cfd = conns[i].sfd = -1;
+
+	for (;;) {
+		if (got_exit)
+			break;
+
+		if (got_report) {
+			report();
+			got_report = 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* write out anything that is due, find the next deadline */
+		timeout = -1;
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (conns[i].cfd == -1)
+				continue;
+
+			if (conn_flush(&conns[i], &now) == -1) {
+				conn_close(&conns[i]);
+				continue;
+			}
+
+			if (conns[i].head == NULL)
+				continue;
+
+			next = conns[i].head->due;
+			n = ts_diff_ms(&next, &now) + 1;
+			if (timeout == -1 || n < timeout)
+				timeout = n;
+		}
+
+		memset(&pfd, 0, sizeof(pfd));
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < MAX_CONNS; i++) {
+			pfd[1 + (i * 2)].fd = conns[i].cfd;
+			pfd[1 + (i * 2)].events = POLLIN;
+			pfd[2 + (i * 2)].fd = conns[i].sfd;
+			pfd[2 + (i * 2)].events = POLLIN;
+		}
+
+		if (poll(pfd, 1 + (MAX_CONNS * 2), timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (pfd[0].revents & POLLIN)
+			conn_accept(lfd);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (conns[i].cfd == -1)
+				continue;
+
+			if ((pfd[1 + (i * 2)].revents & (POLLIN | POLLHUP)) &&
+			    conn_from_client(&conns[i], &now) == -1) {
+				conn_close(&conns[i]);
+				continue;
+			}
+
+			if ((pfd[2 + (i * 2)].revents & (POLLIN | POLLHUP)) &&
+			    conn_from_server(&conns[i]) == -1)
+				conn_close(&conns[i]);
+		}
+	}
+}
+
+void
+conn_accept(int lfd)
+{
+	struct conn *c = NULL;
+	int i, cfd, sfd;
+
+	if ((cfd = accept(lfd, NULL, NULL)) == -1) {
+		warn("accept");
+		return;
+	}
+
+	for (i = 0; i < MAX_CONNS; i++) {
+		if (conns[i].cfd == -1) {
+			c = &conns[i];
+			break;
+		}
+	}
+	if (c == NULL) {
+		warnx("too many clients");
+		close(cfd);
+		return;
+	}
+
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(sfd, (struct sockaddr *)&upstream,
+	    sizeof(upstream)) == -1) {
+		warn("connect %s", upstream.sun_path);
+		if (sfd != -1)
+			close(sfd);
+		close(cfd);
+		return;
+	}
+
+	memset(c, 0, sizeof(struct conn));
+	c->cfd = cfd;
+	c->sfd = sfd;
+
+	DPRINTF(("client %d connected\n", i));
+}
+
+void
+conn_close(struct conn *c)
+{
+	struct chunk *ch;
+
+	DPRINTF(("client %d disconnected\n", (int)(c - conns)));
+
+	/*
+	 * A client may send its last requests and hang up right away, so push
+	 * out whatever is still queued regardless of its due time.
+	 */
+	while ((ch = c->head) != NULL) {
+		if (c->sfd != -1 && writeall(c->sfd, ch->buf + ch->off,
+		    ch->len - ch->off) == -1) {
+			close(c->sfd);
+			c->sfd = -1;
+		}
+		c->head = ch->next;
+		free(ch);
+	}
+
+	close(c->cfd);
+	if (c->sfd != -1)
+		close(c->sfd);
+	c->cfd = c->sfd = -1;
+	c->tail = NULL;
+}
+
+int
+conn_flush(struct conn *c, struct timespec *now)
+{
+	struct chunk *ch;
+
+	while ((ch = c->head) != NULL) {
+		if (ts_diff_ms(&ch->due, now) > 0)
+			break;
+
+		if (writeall(c->sfd, ch->buf + ch->off, ch->len - ch->off) ==
+		    -1)
+			return -1;
+
+		c->head = ch->next;
+		if (c->head == NULL)
+			c->tail = NULL;
+		free(ch);
+	}
+
+	return 0;
+}
+
+int
+conn_from_client(struct conn *c, struct timespec *now)
+{
+	struct chunk *ch;
+	ssize_t len;
+	long delay;
+
+	if ((ch = malloc(sizeof(struct chunk))) == NULL)
+		err(1, "malloc");
+
+	if ((len = read(c->cfd, ch->buf, sizeof(ch->buf))) <= 0) {
+		free(ch);
+		return -1;
+	}
+
+	ch->len = len;
+	ch->off = 0;
+	ch->next = NULL;
+
+	parse_requests(&c->req, ch->buf, len);
+	req_bytes += len;
+
+	delay = latency;
+	if (jitter)
+		delay += (long)arc4random_uniform((jitter * 2) + 1) - jitter;
+	if (delay < 0)
+		delay = 0;
+
+	ch->due = *now;
+	ts_add_ms(&ch->due, delay);
+
+	/* jitter must not reorder the byte stream */
+	if (c->tail && ts_diff_ms(&ch->due, &c->tail->due) < 0)
+		ch->due = c->tail->due;
+
+	if (c->tail)
+		c->tail->next = ch;
+	else
+		c->head = ch;
+	c->tail = ch;
+
+	return 0;
+}
+
+int
+conn_from_server(struct conn *c)
+{
+	unsigned char buf[CHUNK_SIZE];
+	ssize_t len;
+
+	if ((len = read(c->sfd, buf, sizeof(buf))) <= 0)
+		return -1;
+
+	/* the server must answer in the byte order the client asked for */
+	c->rep.msb = c->req.msb;
+	parse_replies(&c->rep, buf, len);
+
+	return writeall(c->cfd, buf, len);
+}
+
+static uint32_t
+xcard(struct xstream *xs, const unsigned char *p, int bytes)
+{
+	if (bytes == 2)
+		return xs->msb ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]);
+
+	return xs->msb ?
+	    (((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) :
+	    (((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]);
+}
+
+#define PAD4(n) (((n) + 3) & ~3)
+
+void
+parse_requests(struct xstream *xs, const unsigned char *buf, size_t len)
+{
+	size_t need, take;
+	uint32_t rlen;
+
+	while (len > 0) {
+		if (xs->skip) {
+			take = (len < xs->skip ? len : xs->skip);
+			xs->skip -= take;
+			buf += take;
+			len -= take;
+			continue;
+		}
+
+		/* connection setup is 12 bytes plus auth name and data */
+		if (!xs->setup_done)
+			need = 12;
+		else if (xs->hdrlen >= 4 && xs->hdr[2] == 0 && xs->hdr[3] == 0)
+			need = 8;	/* BIG-REQUESTS length follows */
+		else
+			need = 4;
+
+		take = need - xs->hdrlen;
+		if (take > len)
+			take = len;
+		memcpy(xs->hdr + xs->hdrlen, buf, take);
+		xs->hdrlen += take;
+		buf += take;
+		len -= take;
+
+		if (xs->hdrlen < need)
+			continue;
+		if (xs->setup_done && need == 4 && xs->hdr[2] == 0 &&
+		    xs->hdr[3] == 0)
+			continue;
+
+		if (!xs->setup_done) {
+			xs->msb = (xs->hdr[0] == 'B');
+			xs->skip = PAD4(xcard(xs, xs->hdr + 6, 2)) +
+			    PAD4(xcard(xs, xs->hdr + 8, 2));
+			xs->setup_done = 1;
+			xs->hdrlen = 0;
+			continue;
+		}
+
+		if (need == 8)
+			rlen = xcard(xs, xs->hdr + 4, 4) * 4;
+		else
+			rlen = xcard(xs, xs->hdr + 2, 2) * 4;
+
+		if (xs->hdr[0] < 128)
+			core_reqs[xs->hdr[0]]++;
+		else
+			ext_reqs[xs->hdr[0] - 128][xs->hdr[1]]++;
+		nreqs++;
+
+		xs->skip = (rlen > need ? rlen - need : 0);
+		xs->hdrlen = 0;
+	}
+}
+
+void
+parse_replies(struct xstream *xs, const unsigned char *buf, size_t len)
+{
+	size_t need, take;
+
+	while (len > 0) {
+		if (xs->skip) {
+			take = (len < xs->skip ? len : xs->skip);
+			xs->skip -= take;
+			buf += take;
+			len -= take;
+			continue;
+		}
+
+		/* setup reply is 8 bytes, everything else is at least 32 */
+		need = (xs->setup_done ? 32 : 8);
+
+		take = need - xs->hdrlen;
+		if (take > len)
+			take = len;
+		memcpy(xs->hdr + xs->hdrlen, buf, take);
+		xs->hdrlen += take;
+		buf += take;
+		len -= take;
+
+		if (xs->hdrlen < need)
+			continue;
+
+		if (!xs->setup_done) {
+			xs->skip = xcard(xs, xs->hdr + 6, 2) * 4;
+			xs->setup_done = 1;
+		} else if (xs->hdr[0] == 1) {
+			/* reply, possibly with extra data */
+			xs->skip = xcard(xs, xs->hdr + 4, 4) * 4;
+			nreplies++;
+		} else if (xs->hdr[0] == 35) {
+			/* GenericEvent, also variable length */
+			xs->skip = xcard(xs, xs->hdr + 4, 4) * 4;
+		}
+
+		xs->hdrlen = 0;
+	}
+}
+
+int
+display_socket(const char *display, struct sockaddr_un *sun, int *nump)
+{
+	const char *errstr;
+	char buf[16];
+	int num;
+
+	if (display[0] != ':')
+		return -1;
+
+	/* ignore any screen number */
+	snprintf(buf, sizeof(buf), "%s", display + 1);
+	buf[strcspn(buf, ".")] = '\0';
+
+	num = strtonum(buf, 0, INT_MAX, &errstr);
+	if (errstr)
+		return -1;
+
+	memset(sun, 0, sizeof(struct sockaddr_un));
+	sun->sun_family = AF_UNIX;
+	if (snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/X%d",
+	    X11_SOCKET_DIR, num) >= (int)sizeof(sun->sun_path))
+		return -1;
+
+	if (nump)
+		*nump = num;
+
+	return 0;
+}
+
+/*
+ * Take /tmp/.X<n>-lock the way X servers do, refusing if its pid is still
+ * alive and replacing it if not.
+ */
+void
+display_lock(int num)
+{
+	const char *errstr;
+	char buf[16];
+	ssize_t len;
+	pid_t pid;
+	int fd, tries;
+
+	snprintf(lockfile, sizeof(lockfile), X11_LOCK_FMT, num);
+
+	for (tries = 0; tries < 2; tries++) {
+		fd = open(lockfile, O_WRONLY | O_CREAT | O_EXCL, 0444);
+		if (fd != -1)
+			break;
+		if (errno != EEXIST)
+			err(1, "%s", lockfile);
+
+		if ((fd = open(lockfile, O_RDONLY)) == -1)
+			err(1, "%s", lockfile);
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			errx(1, "%s: can't read pid", lockfile);
+		buf[len] = '\0';
+		buf[strcspn(buf, "\n")] = '\0';
+
+		pid = strtonum(buf + strspn(buf, " "), 1, INT_MAX, &errstr);
+		if (errstr)
+			errx(1, "%s: bad pid: %s", lockfile, errstr);
+		if (kill(pid, 0) == 0 || errno == EPERM)
+			errx(1, "display :%d is in use by pid %d", num,
+			    (int)pid);
+
+		DPRINTF(("removing stale %s of pid %d\n", lockfile,
+		    (int)pid));
+		if (unlink(lockfile) == -1 && errno != ENOENT)
+			err(1, "unlink %s", lockfile);
+	}
+	if (fd == -1)
+		errx(1, "%s: can't take lock", lockfile);
+
+	/* same format as the X server */
+	len = snprintf(buf, sizeof(buf), "%10d\n", (int)getpid());
+	if (write(fd, buf, len) != len)
+		err(1, "write %s", lockfile);
+	close(fd);
+}
+
+int
+writeall(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+long
+ts_diff_ms(struct timespec *a, struct timespec *b)
+{
+	return ((a->tv_sec - b->tv_sec) * 1000) +
+	    ((a->tv_nsec - b->tv_nsec) / 1000000);
+}
+
+void
+ts_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+void
+report(void)
+{
+	int i, j;
+
+	fprintf(stderr, "%lu requests (%lu bytes), %lu replies\n", nreqs,
+	    req_bytes, nreplies);
+
+	for (i = 0; i < 128; i++)
+		if (core_reqs[i])
+			fprintf(stderr, "  core %3d      %8lu\n", i,
+			    core_reqs[i]);
+
+	for (i = 0; i < 128; i++)
+		for (j = 0; j < 256; j++)
+			if (ext_reqs[i][j])
+				fprintf(stderr, "  ext  %3d.%-3d  %8lu\n",
+				    i + 128, j, ext_reqs[i][j]);
+
+	memset(core_reqs, 0, sizeof(core_reqs));
+	memset(ext_reqs, 0, sizeof(ext_reqs));
+	nreqs = nreplies = req_bytes = 0;
+}
+
+void
+sighandler(int sig)
+{
+	if (sig == SIGUSR1)
+		got_report = 1;
+	else
+		got_exit = 1;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-d] [-j jitter ms] [-l latency ms] "
+	    "listen-display upstream-display\n", __progname);
+	exit(1);
+}